@@ -5,10 +5,11 @@
 // Inspired by posts here: https://stackoverflow.com/questions/28841139/how-to-get-coordinates-of-touchscreen-rawdata-using-linux?noredirect=1&lq=1
 // And kernel docs here: https://www.kernel.org/doc/Documentation/input/input.txt
 // See iwconfig here: http://manpages.ubuntu.com/manpages/trusty/man8/iwconfig.8.html
-// Takes three arguments:
+// Takes up to four arguments:
 // The event input device to watch for key input.
 // The directory to watch for a wpa_supplicant.conf file.
 // The method used to toggle WiFi ("useOverlay" (same as "", default) or "useIwconfig").
+// Optionally "realTime" or "realTime=<CPU>" to handle input in real-time mode (see README).
 
 #include "syshelpers.h"
 
@@ -16,17 +17,34 @@
 #include <fcntl.h>
 #include <linux/input.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <condition_variable>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
 #if defined(__GNUC__) || defined(__clang__)
 #include <experimental/filesystem>
 namespace stdfs = std::experimental::filesystem;
 #endif
 
+// older kernel headers don't have the accessors for the input event timestamp
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
 #define PLAY_AUDIO // Uncomment this to play audio when access is toggled or a wpa config file is found etc.
 const std::string AUDIO_CMD = "aplay --nonblock";
 const std::string DATA_PATH = "/usr/local/share/remoteaccessd/";
@@ -44,9 +62,45 @@ constexpr std::chrono::milliseconds WIFI_TOGGLE_DURATION_MS(2000);
 constexpr std::chrono::milliseconds WPS_START_DURATION_MS(5000);
 constexpr std::chrono::milliseconds IGNORE_DURATION_MS(8000);
 constexpr std::chrono::milliseconds POLL_TIMEOUT_MS(3000);
+constexpr int REALTIME_PRIORITY = 40;                       // SCHED_FIFO priority of the input thread in real-time mode. Below the kernel IRQ threads (50)
+constexpr std::size_t INPUT_THREAD_STACK_SIZE = 256 * 1024; // Stack size of the input thread
+constexpr std::size_t PREFAULT_HEAP_SIZE = 1024 * 1024;     // Heap memory to pre-fault in real-time mode
+constexpr uint32_t SELFTEST_NR_OF_PRESSES = 100;
+constexpr std::chrono::milliseconds SELFTEST_EVENT_INTERVAL_MS(5);
+
+enum class ButtonAction
+{
+    None,
+    ToggleRemoteAccess,
+    StartWPS
+};
+
+/// @brief State of the toggle button as seen by the input thread.
+/// Press durations are computed from the kernel event timestamps, so a delayed read does not change the result.
+struct ButtonState
+{
+    clockid_t clockId = CLOCK_REALTIME; // clock the input event timestamps are taken from
+    bool pressed = false;
+    std::chrono::microseconds pressStart{0};
+    std::chrono::microseconds worstLatency{0}; // worst-case time from input event to its classification
+    uint32_t nrOfEvents = 0;
+};
+
+/// @brief Settings for real-time input handling.
+struct RealTimeSettings
+{
+    bool enabled = false;
+    int cpu = -1; // CPU to pin the input thread to. -1 means not pinned
+};
 
-static bool quit = false;
-static bool actionInProgress = false;
+static std::atomic<bool> quit(false);
+static std::atomic<bool> actionInProgress(false);
+// action posted by the input thread for the worker thread
+static std::mutex actionMutex;
+static std::condition_variable actionCondition;
+static ButtonAction pendingAction = ButtonAction::None;
+static bool workerBusy = false; // worker thread is carrying out an action. guarded by actionMutex
+static std::atomic<bool> inputFailed(false);
 
 static void playWav(const std::string &fileName)
 {
@@ -311,11 +365,203 @@ static void copyConfigFile(const stdfs::path &filePath, const stdfs::path &destD
 /*static void eventToStdout(const input_event &ev)
 {
     std::cout << "Event:" << std::endl;
-    std::cout << "Time: " << ev.time.tv_sec << "." << ev.time.tv_usec << "s, ";
+    std::cout << "Time: " << ev.input_event_sec << "." << ev.input_event_usec << "s, ";
     std::cout << "Type: " << ev.type << ", code: " << ev.code;
     std::cout << ", value: " << ev.value << std::endl;
 }*/
 
+static std::chrono::microseconds eventTime(const input_event &ev)
+{
+    return std::chrono::seconds(ev.input_event_sec) + std::chrono::microseconds(ev.input_event_usec);
+}
+
+static std::chrono::microseconds clockNow(clockid_t clockId)
+{
+    timespec now{};
+    clock_gettime(clockId, &now);
+    return std::chrono::seconds(now.tv_sec) + std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::nanoseconds(now.tv_nsec));
+}
+
+static ButtonAction classifyEvent(ButtonState &state, const input_event &ev)
+{
+    auto action = ButtonAction::None;
+    if (ev.type == EV_KEY && ev.code == TOGGLE_KEYCODE)
+    {
+        const auto time = eventTime(ev);
+        if (ev.value == 1)
+        {
+            state.pressed = true;
+            state.pressStart = time;
+        }
+        else if (ev.value == 0 && state.pressed)
+        {
+            state.pressed = false;
+            const auto pressDuration = time - state.pressStart;
+            if (pressDuration >= WIFI_TOGGLE_DURATION_MS && pressDuration < WPS_START_DURATION_MS)
+            {
+                action = ButtonAction::ToggleRemoteAccess;
+            }
+            else if (pressDuration >= WPS_START_DURATION_MS && pressDuration < IGNORE_DURATION_MS)
+            {
+                action = ButtonAction::StartWPS;
+            }
+        }
+        // keep track of how long it took from the event to its classification
+        state.worstLatency = std::max(state.worstLatency, clockNow(state.clockId) - time);
+        state.nrOfEvents++;
+    }
+    return action;
+}
+
+static void postAction(ButtonAction action)
+{
+    std::lock_guard<std::mutex> lock(actionMutex);
+    // ignore button presses while an action is pending or being carried out
+    if (pendingAction == ButtonAction::None && !workerBusy && !actionInProgress)
+    {
+        pendingAction = action;
+        actionCondition.notify_one();
+    }
+}
+
+/// @brief Read available events from fd, classify them and post the resulting actions to the worker thread if postActions is true.
+/// Returns the number of bytes read, 0 if no data was available or < 0 on error.
+static ssize_t readEvents(int fd, ButtonState &state, bool postActions)
+{
+    std::array<input_event, 64> events{};
+    const auto nrOfBytesRead = read(fd, events.data(), sizeof(events));
+    if (nrOfBytesRead < 0)
+    {
+        if (errno == EAGAIN || errno == EINTR)
+        {
+            return 0;
+        }
+        std::cerr << "Input device read failed: " << std::strerror(errno) << std::endl;
+        return nrOfBytesRead;
+    }
+    //std::cout << nrOfBytesRead << " bytes read" << std::endl;
+    // only handle complete events
+    const auto nrOfEvents = static_cast<std::size_t>(nrOfBytesRead) / sizeof(input_event);
+    for (std::size_t eventIndex = 0; eventIndex < nrOfEvents; eventIndex++)
+    {
+        //eventToStdout(events[eventIndex]);
+        const auto action = classifyEvent(state, events[eventIndex]);
+        if (postActions && action != ButtonAction::None)
+        {
+            postAction(action);
+        }
+    }
+    return nrOfBytesRead;
+}
+
+/// @brief Write synthetic button presses to fd for the real-time self-test, then close fd.
+/// Runs on the normal-priority worker thread, so the events compete with the system load.
+/// The reader may give up early, so SIGPIPE is blocked while writing and EPIPE ends the test.
+static void writeSelfTestEvents(int fd)
+{
+    sigset_t sigPipe;
+    sigemptyset(&sigPipe);
+    sigaddset(&sigPipe, SIGPIPE);
+    sigset_t oldMask;
+    pthread_sigmask(SIG_BLOCK, &sigPipe, &oldMask);
+    for (uint32_t i = 0; i < 2 * SELFTEST_NR_OF_PRESSES && !quit; i++)
+    {
+        const auto now = clockNow(CLOCK_MONOTONIC);
+        input_event ev{};
+        ev.input_event_sec = std::chrono::duration_cast<std::chrono::seconds>(now).count();
+        ev.input_event_usec = (now % std::chrono::seconds(1)).count();
+        ev.type = EV_KEY;
+        ev.code = TOGGLE_KEYCODE;
+        ev.value = (i % 2 == 0) ? 1 : 0;
+        if (write(fd, &ev, sizeof(ev)) != static_cast<ssize_t>(sizeof(ev)))
+        {
+            if (errno != EPIPE)
+            {
+                std::cerr << "Failed to write self-test event: " << std::strerror(errno) << std::endl;
+            }
+            break;
+        }
+        std::this_thread::sleep_for(SELFTEST_EVENT_INTERVAL_MS);
+    }
+    close(fd);
+    // discard a pending SIGPIPE before unblocking it again
+    const timespec noWait{};
+    while (sigtimedwait(&sigPipe, nullptr, &noWait) == SIGPIPE)
+    {
+    }
+    pthread_sigmask(SIG_SETMASK, &oldMask, nullptr);
+}
+
+/// @brief Classify the synthetic button presses from writeSelfTestEvents() read from fd and report the worst-case latency.
+/// The presses are too short to trigger any action.
+static void runSelfTest(int fd)
+{
+    ButtonState state;
+    state.clockId = CLOCK_MONOTONIC;
+    pollfd selfTestPipe = {fd, POLLIN, 0};
+    while (!quit && poll(&selfTestPipe, 1, POLL_TIMEOUT_MS.count()) > 0 && readEvents(fd, state, false) > 0)
+    {
+    }
+    close(fd);
+    std::cout << "Self-test: Worst-case input-to-classification latency " << state.worstLatency.count() << "us over " << state.nrOfEvents << " events" << std::endl;
+}
+
+struct InputThreadArgs
+{
+    int deviceFd = -1;
+    clockid_t clockId = CLOCK_REALTIME; // clock the input device timestamps events with
+    RealTimeSettings realTime;
+    int selfTestFd = -1; // read end of self-test pipe, used in real-time mode only
+};
+
+/// @brief Input thread. Only reads and classifies button presses. All actions are carried out by the worker thread.
+static void *inputThread(void *arg)
+{
+    const auto &args = *static_cast<const InputThreadArgs *>(arg);
+    if (args.realTime.enabled)
+    {
+        prefaultStack();
+        if (args.realTime.cpu >= 0 && pinThreadToCpu(args.realTime.cpu))
+        {
+            std::cout << "Input thread pinned to CPU " << args.realTime.cpu << std::endl;
+        }
+        if (setThreadScheduling(SCHED_FIFO, REALTIME_PRIORITY))
+        {
+            std::cout << "Input thread running with SCHED_FIFO priority " << REALTIME_PRIORITY << std::endl;
+        }
+        runSelfTest(args.selfTestFd);
+    }
+    ButtonState state;
+    state.clockId = args.clockId;
+    pollfd inputDevice = {args.deviceFd, POLLIN, 0};
+    while (!quit)
+    {
+        // poll input device for events
+        if (poll(&inputDevice, 1, POLL_TIMEOUT_MS.count()) > 0)
+        {
+            // don't retry a removed or broken device. this thread might be running with real-time priority
+            if ((inputDevice.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0)
+            {
+                std::cerr << "Input device failed or was removed. Quitting..." << std::endl;
+                break;
+            }
+            if (inputDevice.revents != 0 && readEvents(inputDevice.fd, state, true) < 0)
+            {
+                std::cerr << "Quitting..." << std::endl;
+                break;
+            }
+        } // else an error or poll timeout occurred, so no events arrived
+    }
+    if (!quit)
+    {
+        // have the worker quit too, so the service is restarted
+        inputFailed = true;
+        quit = true;
+    }
+    std::cout << "Worst-case input-to-classification latency " << state.worstLatency.count() << "us over " << state.nrOfEvents << " events" << std::endl;
+    return nullptr;
+}
+
 static void signalHandler(int signum)
 {
     std::cout << "Signal received: " << signum << ". Quitting..." << std::endl;
@@ -325,9 +571,9 @@ static void signalHandler(int signum)
 auto main(int argc, char *argv[]) -> int
 {
     int returnValue = 0;
-    pollfd inputDevice = {0, 0, 0};
-    std::array<input_event, 64> events{};
-    auto buttonPressStart = std::chrono::system_clock::now();
+    InputThreadArgs inputThreadArgs;
+    pthread_t inputThreadId{};
+    bool inputThreadRunning = false;
     bool dirExists = false;
     bool toggleWiFiByOverlay = true;
     try
@@ -337,34 +583,50 @@ auto main(int argc, char *argv[]) -> int
             std::cerr << "Must be run as root!" << std::endl;
             return 4;
         }
-        if (argc < 3 || argc > 4)
+        if (argc < 3 || argc > 5)
         {
-            std::cerr << "Must specify input device, watch directory and optionally WiFi toggle mode, e.g." << std::endl;
-            std::cerr << "e.g. remoteaccessd /dev/input/event2 /media/usb/ useOverlay" << std::endl;
+            std::cerr << "Must specify input device, watch directory and optionally WiFi toggle mode and real-time mode, e.g." << std::endl;
+            std::cerr << "e.g. remoteaccessd /dev/input/event2 /media/usb/ useOverlay realTime=3" << std::endl;
             return 2;
         }
-        // check which method toggle WiFi with
-        if (argc == 4)
+        // check which method toggle WiFi with and if we should run in real-time mode
+        for (int argIndex = 3; argIndex < argc; argIndex++)
         {
-            const std::string argv3(argv[3]);
-            if (argv3 == "useIwconfig")
+            const std::string option(argv[argIndex]);
+            const std::string realTimeCpuPrefix = "realTime=";
+            if (option == "useIwconfig")
             {
                 toggleWiFiByOverlay = false;
             }
-            else if (argv3 == "useOverlay")
+            else if (option == "useOverlay")
             {
                 toggleWiFiByOverlay = true;
             }
+            else if (option == "realTime")
+            {
+                inputThreadArgs.realTime.enabled = true;
+            }
+            else if (option.compare(0, realTimeCpuPrefix.size(), realTimeCpuPrefix) == 0)
+            {
+                const auto cpu = option.substr(realTimeCpuPrefix.size());
+                if (cpu.empty() || cpu.size() > 4 || cpu.find_first_not_of("0123456789") != std::string::npos)
+                {
+                    std::cerr << "Invalid CPU \"" << cpu << "\" for real-time mode" << std::endl;
+                    return 2;
+                }
+                inputThreadArgs.realTime.enabled = true;
+                inputThreadArgs.realTime.cpu = std::stoi(cpu);
+            }
             else
             {
-                std::cerr << "Unknown WiFi toggle mode \"" << argv3 << R"(". Use "useIwconfig" or "useOverlay")" << std::endl;
+                std::cerr << "Unknown option \"" << option << R"(". Use "useIwconfig", "useOverlay", "realTime" or "realTime=<CPU>")" << std::endl;
                 return 2;
             }
         }
         // open input device for reading
         const std::string keyDevice = argv[1];
-        inputDevice.fd = open(keyDevice.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
-        if (inputDevice.fd < 0)
+        inputThreadArgs.deviceFd = open(keyDevice.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (inputThreadArgs.deviceFd < 0)
         {
             std::cerr << "Failed to open \"" << keyDevice << "\" for reading" << std::endl;
             return 1;
@@ -372,10 +634,16 @@ auto main(int argc, char *argv[]) -> int
         std::cout << "Opened \"" << keyDevice << "\" for reading" << std::endl;
         // get input device name
         std::array<char, 512> inputDeviceName{};
-        if (ioctl(inputDevice.fd, EVIOCGNAME(sizeof(inputDeviceName)), inputDeviceName.data()) >= 0)
+        if (ioctl(inputThreadArgs.deviceFd, EVIOCGNAME(sizeof(inputDeviceName)), inputDeviceName.data()) >= 0)
         {
             std::cout << "Device name: \"" << inputDeviceName.data() << "\"" << std::endl;
         }
+        // have events timestamped with the monotonic clock, so press durations don't jump with the system time
+        int clockId = CLOCK_MONOTONIC;
+        if (ioctl(inputThreadArgs.deviceFd, EVIOCSCLOCKID, &clockId) >= 0)
+        {
+            inputThreadArgs.clockId = CLOCK_MONOTONIC;
+        }
         // check watch directory
         const std::string usbDirectory = argv[2];
         const auto watchDir = stdfs::path(usbDirectory);
@@ -393,63 +661,65 @@ auto main(int argc, char *argv[]) -> int
         {
             signal(SIGTERM, SIG_IGN);
         }
-        // run event loop
+        // in real-time mode lock all memory so reading input never causes page faults and set up the self-test pipe
+        std::array<int, 2> selfTestPipe = {-1, -1};
+        if (inputThreadArgs.realTime.enabled)
+        {
+            std::cout << "Running in real-time mode" << std::endl;
+            if (!lockProcessMemory(PREFAULT_HEAP_SIZE))
+            {
+                std::cerr << "Real-time mode degraded: Memory not locked, input handling may be delayed by page faults" << std::endl;
+            }
+            if (pipe2(selfTestPipe.data(), O_CLOEXEC) != 0)
+            {
+                std::cerr << "Failed to create self-test pipe" << std::endl;
+                close(inputThreadArgs.deviceFd);
+                return 1;
+            }
+            inputThreadArgs.selfTestFd = selfTestPipe[0];
+        }
+        // start input thread with a small stack, as that is locked into RAM in real-time mode
+        pthread_attr_t inputThreadAttr;
+        pthread_attr_init(&inputThreadAttr);
+        pthread_attr_setstacksize(&inputThreadAttr, INPUT_THREAD_STACK_SIZE);
+        inputThreadRunning = pthread_create(&inputThreadId, &inputThreadAttr, inputThread, &inputThreadArgs) == 0;
+        pthread_attr_destroy(&inputThreadAttr);
+        if (!inputThreadRunning)
+        {
+            std::cerr << "Failed to start input thread" << std::endl;
+            close(inputThreadArgs.deviceFd);
+            return 1;
+        }
+        if (inputThreadArgs.realTime.enabled)
+        {
+            writeSelfTestEvents(selfTestPipe[1]);
+        }
+        // run worker loop. this does all the heavy lifting
         while (!quit)
         {
-            // poll input device for events
-            inputDevice.events = POLLIN;
-            if (poll(&inputDevice, 1, POLL_TIMEOUT_MS.count()) > 0)
+            // wait for an action from the input thread. on timeout check the directory
+            auto action = ButtonAction::None;
             {
-                if (inputDevice.revents != 0)
-                {
-                    const auto nrOfBytesRead = read(inputDevice.fd, events.data(), sizeof(events));
-                    if (nrOfBytesRead < 0)
-                    {
-                        std::cerr << "Input device read failed: " << nrOfBytesRead << std::endl;
-                    }
-                    else
-                    {
-                        //std::cout << nrOfBytesRead << " bytes read" << std::endl;
-                        // check if we have enough data for a complete event
-                        if (nrOfBytesRead >= static_cast<ssize_t>(sizeof(input_event)))
-                        {
-                            uint32_t eventIndex = 0;
-                            ssize_t byteIndex = 0;
-                            while (eventIndex < 64 && byteIndex < nrOfBytesRead)
-                            {
-                                const auto &ev = events[eventIndex];
-                                //eventToStdout(ev);
-                                if (ev.type == EV_KEY && ev.code == TOGGLE_KEYCODE)
-                                {
-                                    if (ev.value == 1)
-                                    {
-                                        buttonPressStart = std::chrono::system_clock::now();
-                                    }
-                                    else if (ev.value == 0)
-                                    {
-                                        auto pressDuration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - buttonPressStart);
-                                        if (pressDuration >= WIFI_TOGGLE_DURATION_MS && pressDuration < WPS_START_DURATION_MS)
-                                        {
-                                            toggleRemoteAccess(toggleWiFiByOverlay);
-                                        }
-                                        else if (pressDuration >= WPS_START_DURATION_MS && pressDuration < IGNORE_DURATION_MS)
-                                        {
-                                            startWPSConnection(toggleWiFiByOverlay);
-                                        }
-                                    }
-                                }
-                                // skip to next event
-                                byteIndex += sizeof(input_event);
-                                eventIndex++;
-                            }
-                        }
-                    }
-                }
-                else
-                {
-                    std::cerr << "Error polling input device" << std::endl;
-                }
-            } // else an error or poll timeout occurred, so no events arrived
+                std::unique_lock<std::mutex> lock(actionMutex);
+                actionCondition.wait_for(lock, POLL_TIMEOUT_MS, [] { return pendingAction != ButtonAction::None; });
+                action = pendingAction;
+                pendingAction = ButtonAction::None;
+                // button presses while the action is carried out are ignored
+                workerBusy = action != ButtonAction::None;
+            }
+            if (action == ButtonAction::ToggleRemoteAccess)
+            {
+                toggleRemoteAccess(toggleWiFiByOverlay);
+            }
+            else if (action == ButtonAction::StartWPS)
+            {
+                startWPSConnection(toggleWiFiByOverlay);
+            }
+            if (action != ButtonAction::None)
+            {
+                std::lock_guard<std::mutex> lock(actionMutex);
+                workerBusy = false;
+            }
             // now check the directory for a wpa_supplicant.conf file
             try
             {
@@ -491,6 +761,15 @@ auto main(int argc, char *argv[]) -> int
     {
         returnValue = 1;
     }
-    close(inputDevice.fd);
+    quit = true;
+    if (inputThreadRunning)
+    {
+        pthread_join(inputThreadId, nullptr);
+    }
+    if (inputFailed)
+    {
+        returnValue = 1;
+    }
+    close(inputThreadArgs.deviceFd);
     return returnValue;
 }
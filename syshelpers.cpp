@@ -1,6 +1,17 @@
 #include "syshelpers.h"
 
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <regex>
 
 std::string stem(const std::string &path)
@@ -118,3 +129,66 @@ bool isFileContentSame(const stdfs::path &fileA, const stdfs::path &fileB)
 {
     return systemCommand("diff \"" + fileA.string() + "\" \"" + fileB.string() + "\"");
 }
+
+bool lockProcessMemory(std::size_t prefaultHeapSize)
+{
+    const bool locked = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+    if (!locked)
+    {
+        std::cerr << "Failed to lock process memory: " << std::strerror(errno) << std::endl;
+    }
+    // never give heap memory back to the system and never use mmap() for allocations, so
+    // memory touched once stays mapped and locked
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    // allocate and touch heap, then free it again. it will stay in the process due to the settings above
+    const auto pageSize = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    auto heap = static_cast<volatile char *>(std::malloc(prefaultHeapSize));
+    if (heap != nullptr)
+    {
+        for (std::size_t i = 0; i < prefaultHeapSize; i += pageSize)
+        {
+            heap[i] = 0;
+        }
+        std::free(const_cast<char *>(heap));
+    }
+    return locked;
+}
+
+void prefaultStack()
+{
+    std::array<char, PREFAULT_STACK_SIZE> stack;
+    const auto pageSize = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    volatile char *data = stack.data();
+    for (std::size_t i = 0; i < stack.size(); i += pageSize)
+    {
+        data[i] = 0;
+    }
+}
+
+bool setThreadScheduling(int policy, int priority)
+{
+    sched_param param{};
+    param.sched_priority = priority;
+    const auto result = pthread_setschedparam(pthread_self(), policy, &param);
+    if (result != 0)
+    {
+        std::cerr << "Failed to set thread scheduling policy " << policy << ", priority " << priority << ": " << std::strerror(result) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool pinThreadToCpu(int cpu)
+{
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu, &cpuSet);
+    const auto result = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+    if (result != 0)
+    {
+        std::cerr << "Failed to pin thread to CPU " << cpu << ": " << std::strerror(result) << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -1,6 +1,7 @@
 // Linux system helper utilities. Should maybe be in a seperate repo...
 #pragma once
 
+#include <cstddef>
 #include <string>
 
 #if defined(__GNUC__) || defined(__clang__)
@@ -41,3 +42,17 @@ std::string getIPv4Address(const std::string &deviceName);
 
 /// @brief Returns true if the two files passed have the same content (names and stats can be different).
 bool isFileContentSame(const stdfs::path &fileA, const stdfs::path &fileB);
+
+/// @brief Lock all current and future pages of the process into RAM and pre-fault heap memory of the given size.
+/// The heap is kept from shrinking afterwards, so later allocations do not cause page faults.
+/// The heap is pre-faulted even if locking fails. Returns false if the memory could not be locked.
+bool lockProcessMemory(std::size_t prefaultHeapSize);
+/// @brief Amount of stack memory touched by prefaultStack().
+constexpr std::size_t PREFAULT_STACK_SIZE = 64 * 1024;
+/// @brief Touch PREFAULT_STACK_SIZE bytes of stack memory of the calling thread, so later use does not cause page faults.
+void prefaultStack();
+
+/// @brief Set scheduling policy (e.g. SCHED_FIFO or SCHED_OTHER) and priority of the calling thread.
+bool setThreadScheduling(int policy, int priority);
+/// @brief Restrict the calling thread to run on a single CPU only.
+bool pinThreadToCpu(int cpu);